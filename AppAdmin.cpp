@@ -26,11 +26,81 @@
 
 extern long loadCumulativeDuration;
 extern long loadTotalDuration;
+
+const char*   pmIOCounterDef(int counter);
+unsigned long pmIOCount(int counter);
+int           pmHistoryBytes();
+int           phCalibrationHandle();
+int           debugHandleLimit();
+
+#define INDEXED_INSTANCES 64
+
+#define PROFILE_HANDLE 51
+#define PROFILED_SLOTS 8
+
+#define SCANNED_HANDLES 256
+#define CHUNK_ROWS 8
+
+#define LOG_STEP 200
+
+#define SORT_AVG 0
+#define SORT_MAX 1
+#define SORT_P99 2
+
 namespace admin {
 
     char _alarmPort;
 
+    // INSTANCE INDEX
+    // Built from the instance table and rebuilt after adding or removing an
+    // instance, so the dialogs and the dashboard do not rescan all instances.
+    // Only the first INDEXED_INSTANCES removables and monitoreables are kept,
+    // the ones past them are found by scanning.
+    char          indexValid;
+    int           indexedInstances;
+    unsigned char instancesOfDescriptor[NUMBER_OF_DESCRIPTORS];
+    unsigned char addables[NUMBER_OF_DESCRIPTORS];
+    int           numberOfAddables;
+    unsigned char removables[INDEXED_INSTANCES];
+    int           numberOfRemovables;
+    unsigned char monitoreables[INDEXED_INSTANCES];
+    int           numberOfMonitoreables;
+
+    // PROFILER
+    // Microseconds the dashboard spends in the monitors, for as many
+    // instances as the screen shows. When the slots are full, a slower
+    // instance takes the slot with the lowest average. The average is a
+    // moving one and the p99 is estimated while recording (frugal
+    // streaming), so no samples are kept.
+    unsigned char profileInstance[PROFILED_SLOTS];  // instance + 1, 0 if unused
+    uint16_t      profileMin[PROFILED_SLOTS];
+    uint16_t      profileMax[PROFILED_SLOTS];
+    uint16_t      profileAvg[PROFILED_SLOTS];
+    uint16_t      profileP99[PROFILED_SLOTS];
+    char          profileSort;
+
+    // instance shown on the chunks screen
+    int           inspectedInstance;
+
+    // CHUNKS
+    // The largest users of the persistant heap, as of the last scan.
+    unsigned char chunkRowInstance[CHUNK_ROWS];
+    uint16_t      chunkRowBytes[CHUNK_ROWS];
+    unsigned char chunkRowCount[CHUNK_ROWS];
+    char          chunkRows;
+    long          chunkTotal;
+
     void startScreen();
+    void screenMem();
+    void screenMore();
+    void nextProfileSort(int param);
+    void resetProfiler();
+    void exportProfile(int param);
+    void clearProfile(int param);
+    void showChunkDetail(int param);
+    void screenChunks();
+    void openChunks(int param);
+    const char* logLabels(int i);
 
     int cardinality() {
         return APP_CARDINALITY_ALWAYS_ONE;
@@ -50,30 +120,72 @@ namespace admin {
         return _alarmPort;
     }
 
-    int canAdd(int type) {
+    int canAdd(int descriptor) {
+        int type = getDescriptor(descriptor);
         if (cardinalityForType(type) == APP_CARDINALITY_UNDEFINED)
             return 1;
         if (cardinalityForType(type) == APP_CARDINALITY_ALWAYS_ONE)
             return 0;
+        return instancesOfDescriptor[descriptor] == 0;
+    }
+
+    int isRemovable(int instance) {
+        return cardinalityForInstance(instance) != APP_CARDINALITY_ALWAYS_ONE;
+    }
+
+    // the k-th removable (or monitoreable) instance, -1 if there is none
+    int scanInstances(int k, int monitoreable) {
         for (int i = 0; i < numberOfInstances(); i++)
-            if (idForInstance(i) == type)
-                return 0;
-        return 1;
+            if ((monitoreable ? hasMonitorForInstance(i) : isRemovable(i)) && k-- == 0)
+                return i;
+        return -1;
+    }
+
+    int removable(int k) {
+        return k < INDEXED_INSTANCES ? removables[k] : scanInstances(k, 0);
+    }
+
+    int monitoreable(int k) {
+        return k < INDEXED_INSTANCES ? monitoreables[k] : scanInstances(k, 1);
+    }
+
+    void buildIndex() {
+        int n = numberOfInstances();
+        for (int d = 0; d < NUMBER_OF_DESCRIPTORS; d++)
+            instancesOfDescriptor[d] = 0;
+        numberOfRemovables = numberOfMonitoreables = 0;
+        for (int i = 0; i < n; i++) {
+            instancesOfDescriptor[getDescriptorIndex(idForInstance(i))]++;
+            if (isRemovable(i) && numberOfRemovables++ < INDEXED_INSTANCES)
+                removables[numberOfRemovables - 1] = i;
+            if (hasMonitorForInstance(i) && numberOfMonitoreables++ < INDEXED_INSTANCES)
+                monitoreables[numberOfMonitoreables - 1] = i;
+        }
+        numberOfAddables = 0;
+        for (int d = 0; d < NUMBER_OF_DESCRIPTORS; d++)
+            if (canAdd(d))
+                addables[numberOfAddables++] = d;
+        if (indexedInstances != n)
+            resetProfiler();
+        indexedInstances = n;
+        indexValid = 1;
+    }
+
+    void checkIndex() {
+        if (!indexValid || indexedInstances != numberOfInstances())
+            buildIndex();
     }
 
     int getAddableIdIndex(int a) {
-        for (int i = 0; i < NUMBER_OF_DESCRIPTORS; i++)
-            if (canAdd(getDescriptor(i)))
-                if (a-- == 0)
-                    return i;
-        return -1;
+        checkIndex();
+        if (a < 0 || a >= numberOfAddables)
+            return -1;
+        return addables[a];
     }
 
     int numberOfIdsThatCanBeAdded() {
-        int i = 0;
-        while (getAddableIdIndex(i) >= 0)
-            i++;
-        return i;
+        checkIndex();
+        return numberOfAddables;
     }
 
     void screenAdded() {
@@ -103,6 +215,7 @@ namespace admin {
     void addCallback(int selected, int button) {
         if (selected >= 0 && selected < numberOfIdsThatCanBeAdded() && button >= 0) {
             launchDescriptor(getAddableIdIndex(selected));
+            indexValid = 0;
             goToScreen(screenAdded);
         } else
             goToScreen(startScreen);
@@ -111,27 +224,22 @@ namespace admin {
     // REMOVING
 
     int removableInstance(int instance) {
-        for (int i = 0; i < numberOfInstances(); i++)
-            if (cardinalityForInstance(i) != APP_CARDINALITY_ALWAYS_ONE)
-                if (--instance == -1)
-                    return i;
+        checkIndex();
+        if (instance >= 0 && instance < numberOfRemovables)
+            return removable(instance);
         fatalError(1000, instance);
         return 0;
     }
 
     int numberOfRemoveables() {
-        int n = 0;
-        for (int i = 0; i < numberOfInstances(); i++)
-            if (cardinalityForInstance(i) != APP_CARDINALITY_ALWAYS_ONE)
-                n++;
-        return n;
+        checkIndex();
+        return numberOfRemovables;
     }
 
     const char* removeLabels(int instance) {
-        for (int i = 0; i < numberOfInstances(); i++)
-            if (cardinalityForInstance(i) != APP_CARDINALITY_ALWAYS_ONE)
-                if (--instance == -1)
-                    return nameForInstance(i);
+        checkIndex();
+        if (instance >= 0 && instance < numberOfRemovables)
+            return nameForInstance(removable(instance));
         return 0;
     }
 
@@ -144,12 +252,294 @@ namespace admin {
                         startScreen);
             else {
                 removeInstanceAt(removableInstance(instance));
+                indexValid = 0;
                 message(PSTR("The app was removed."), startScreen);
             }
         } else
             goToScreen(startScreen);
     }
 
+    // PROFILER
+
+    // slot of the instance, or the one it may take, -1 if it is too fast
+    int profileSlot(int instance, uint16_t d) {
+        int slot = -1;
+        for (int k = 0; k < PROFILED_SLOTS; k++) {
+            if (profileInstance[k] == instance + 1)
+                return k;
+            if (slot == -1 || profileInstance[k] == 0 ||
+                (profileInstance[slot] != 0 && profileAvg[k] < profileAvg[slot]))
+                slot = k;
+        }
+        if (profileInstance[slot] != 0 && d <= profileAvg[slot])
+            return -1;
+        profileInstance[slot] = instance + 1;
+        profileMin[slot] = profileMax[slot] = profileAvg[slot] = profileP99[slot] = d;
+        return slot;
+    }
+
+    void record(int instance, unsigned long duration) {
+        if (instance < 0 || instance >= 255)
+            return;
+        uint16_t d = duration > 65535 ? 65535 : duration;
+        int k = profileSlot(instance, d);
+        if (k == -1)
+            return;
+        if (d < profileMin[k])
+            profileMin[k] = d;
+        if (d > profileMax[k])
+            profileMax[k] = d;
+        profileAvg[k] += ((long)d - profileAvg[k]) / 8;
+        uint16_t q = profileP99[k];
+        uint16_t step = 1 + q / 16;
+        if (d > q && random(100) < 99)
+            profileP99[k] = d - q < step ? d : q + step;
+        else if (d < q && random(100) < 1)
+            profileP99[k] = q - d < step ? d : q - step;
+    }
+
+    // instances are renumbered when one is removed, so the index rebuild
+    // starts the profile again
+    void resetProfiler() {
+        for (int k = 0; k < PROFILED_SLOTS; k++)
+            profileInstance[k] = 0;
+    }
+
+    int profilerBytes() {
+        return sizeof(profileInstance) + sizeof(profileMin) + sizeof(profileMax) + sizeof(profileAvg) +
+               sizeof(profileP99);
+    }
+
+    uint16_t sortValue(int k) {
+        if (profileSort == SORT_MAX)
+            return profileMax[k];
+        if (profileSort == SORT_P99)
+            return profileP99[k];
+        return profileAvg[k];
+    }
+
+    void printColumn(int x, uint16_t value) {
+        setPrintX(x);
+        print(value);
+    }
+
+    void screenProfiler() {
+        int order[PROFILED_SLOTS];
+        int n = 0;
+        for (int k = 0; k < PROFILED_SLOTS; k++) {
+            if (profileInstance[k] == 0)
+                continue;
+            int j = n++;
+            for (; j > 0 && sortValue(order[j - 1]) < sortValue(k); j--)
+                order[j] = order[j - 1];
+            order[j] = k;
+        }
+        println(PSTR("Monitor, microseconds per call:"));
+        println();
+        setBoldStyle();
+        print(PSTR("App"));
+        setPrintX(130);
+        print(PSTR("Min"));
+        setPrintX(175);
+        print(profileSort == SORT_AVG ? PSTR("Avg*") : PSTR("Avg"));
+        setPrintX(220);
+        print(profileSort == SORT_MAX ? PSTR("Max*") : PSTR("Max"));
+        setPrintX(265);
+        println(profileSort == SORT_P99 ? PSTR("P99*") : PSTR("P99"));
+        setNormalStyle();
+        if (!n)
+            println(PSTR("Nothing recorded yet, open the dashboard."));
+        for (int r = 0; r < n; r++) {
+            int k = order[r];
+            print(nameForInstance(profileInstance[k] - 1));
+            printColumn(130, profileMin[k]);
+            printColumn(175, profileAvg[k]);
+            printColumn(220, profileMax[k]);
+            printColumn(265, profileP99[k]);
+            println();
+        }
+        toolbarAdd(PSTR("Sort"), nextProfileSort);
+        toolbarAdd(PSTR("Export"), exportProfile);
+        toolbarAdd(PSTR("Reset"), clearProfile);
+        toolbarAdd(mini, 1, PSTR("<<"), screenMem);
+    }
+
+    void nextProfileSort(int param) {
+        profileSort = (profileSort + 1) % 3;
+        goToScreen(screenProfiler);
+    }
+
+    void clearProfile(int param) {
+        resetProfiler();
+        goToScreen(screenProfiler);
+    }
+
+    /*
+     PROFILE CHUNK
+
+     BYTE 0: number of profiled instances
+     then per instance: the instance, and little endian min, avg, max, p99
+     */
+    void exportProfile(int param) {
+        int n = 0;
+        for (int k = 0; k < PROFILED_SLOTS; k++)
+            if (profileInstance[k] != 0)
+                n++;
+        if (chunkForHandleExists(PROFILE_HANDLE))
+            deallocChunk(PROFILE_HANDLE);
+        allocChunk(PROFILE_HANDLE, 1 + n * 9);
+        pset(PROFILE_HANDLE, 0, n);
+        int p = 1;
+        for (int k = 0; k < PROFILED_SLOTS; k++) {
+            if (profileInstance[k] == 0)
+                continue;
+            uint16_t values[] = {profileMin[k], profileAvg[k], profileMax[k], profileP99[k]};
+            pset(PROFILE_HANDLE, p++, profileInstance[k] - 1);
+            for (int v = 0; v < 4; v++) {
+                pset(PROFILE_HANDLE, p++, values[v] & 0xFF);
+                pset(PROFILE_HANDLE, p++, values[v] >> 8);
+            }
+        }
+        message(PSTR("The profile was exported."), screenProfiler);
+    }
+
+    // CHUNKS
+    // Chunks are looked up by handle in the context of each instance, so a
+    // scan of all handles tells where the persistant heap went.
+
+    const char* handleName(int handle) {
+        if (handle == LOG_HANDLE)
+            return PSTR("Log");
+        if (handle == NAME_HANDLE)
+            return PSTR("Name");
+        if (handle == phCalibrationHandle())
+            return PSTR("Calibration");
+        if (handle == PROFILE_HANDLE)
+            return PSTR("Profile");
+        return 0;
+    }
+
+    // the debug app hands out handles past the usual ones
+    int scannedHandles() {
+        return debugHandleLimit() > SCANNED_HANDLES ? debugHandleLimit() : SCANNED_HANDLES;
+    }
+
+    // bytes in chunks of the instance, and how many chunks
+    long chunkBytes(int instance, int* chunks) {
+        long bytes = 0;
+        *chunks = 0;
+        int  last = scannedHandles();
+        switchContextToInstance(instance);
+        for (int handle = 0; handle < last; handle++)
+            if (chunkForHandleExists(handle)) {
+                bytes += chunkSize(handle);
+                (*chunks)++;
+            }
+        popContext();
+        return bytes;
+    }
+
+    // The scan switches to every instance, so it runs when the Chunks screen
+    // is opened and the rows are kept while browsing the details.
+    void scanChunks() {
+        chunkRows = 0;
+        chunkTotal = 0;
+        for (int i = 0; i < numberOfInstances() && i < 255; i++) {
+            int c;
+            long b = chunkBytes(i, &c);
+            chunkTotal += b;
+            if (!c || (chunkRows == CHUNK_ROWS && b <= chunkRowBytes[CHUNK_ROWS - 1]))
+                continue;
+            int j = chunkRows < CHUNK_ROWS ? chunkRows++ : CHUNK_ROWS - 1;
+            for (; j > 0 && chunkRowBytes[j - 1] < b; j--) {
+                chunkRowInstance[j] = chunkRowInstance[j - 1];
+                chunkRowBytes[j] = chunkRowBytes[j - 1];
+                chunkRowCount[j] = chunkRowCount[j - 1];
+            }
+            chunkRowInstance[j] = i;
+            chunkRowBytes[j] = b;
+            chunkRowCount[j] = c;
+        }
+    }
+
+    void openChunks(int param) {
+        scanChunks();
+        goToScreen(screenChunks);
+    }
+
+    void screenChunkDetail() {
+        print(PSTR("Chunks of "));
+        setBoldStyle();
+        println(nameForInstance(inspectedInstance));
+        setNormalStyle();
+        println();
+        int rows = 0;
+        long total = 0;
+        int  last = scannedHandles();
+        switchContextToInstance(inspectedInstance);
+        for (int handle = 0; handle < last; handle++) {
+            if (!chunkForHandleExists(handle))
+                continue;
+            total += chunkSize(handle);
+            if (rows++ >= 8)
+                continue;
+            if (handleName(handle))
+                print(handleName(handle));
+            else {
+                print(PSTR("Handle "));
+                print(handle);
+            }
+            setPrintX(180);
+            print(chunkSize(handle));
+            println(PSTR(" bytes"));
+        }
+        popContext();
+        if (!rows)
+            println(PSTR("No chunks."));
+        else if (rows > 8) {
+            print(rows - 8);
+            println(PSTR(" more chunks..."));
+        }
+        printAlignedRight(PSTR("Total: "), 180);
+        setPrintX(180);
+        print(total);
+        println(PSTR(" bytes"));
+        toolbarAdd(PSTR("Detail"), showChunkDetail);
+        toolbarAdd(PSTR("<<"), screenChunks);
+    }
+
+    void chunkDetailCallback(int selected, int button) {
+        if (selected >= 0 && selected < numberOfInstances() && button >= 0) {
+            inspectedInstance = selected;
+            goToScreen(screenChunkDetail);
+        } else
+            goToScreen(screenChunks);
+    }
+
+    void showChunkDetail(int param) {
+        showSelectDialog(PSTR("Detail"), 2, logLabels, chunkDetailCallback, 0,
+                         PSTR("Select an instance to see its chunks by handle."));
+    }
+
+    void screenChunks() {
+        println(PSTR("Persistant heap used by chunks:"));
+        println();
+        for (int r = 0; r < chunkRows; r++) {
+            print(nameForInstance(chunkRowInstance[r]));
+            setPrintX(150);
+            print(chunkRowBytes[r]);
+            print(PSTR(" bytes in "));
+            print((int)chunkRowCount[r]);
+            println(chunkRowCount[r] == 1 ? PSTR(" chunk") : PSTR(" chunks"));
+        }
+        printAlignedRight(PSTR("Total: "), 150);
+        setPrintX(150);
+        print(chunkTotal);
+        println(PSTR(" bytes"));
+        toolbarAdd(PSTR("Detail"), showChunkDetail);
+        toolbarAdd(PSTR("<<"), screenMem);
+    }
+
     // MEM INFO SCREEN
 
     void screenMem() {
@@ -166,6 +556,21 @@ namespace admin {
         setPrintX(180);
         print(currentLoad());
         println(PSTR("%"));
+        for (int i = 0; pmIOCounterDef(i); i++) {
+            printAlignedRight(pmIOCounterDef(i), 180);
+            setPrintX(180);
+            println(pmIOCount(i));
+        }
+        printAlignedRight(PSTR("Port history: "), 180);
+        setPrintX(180);
+        print(pmHistoryBytes());
+        println(PSTR(" bytes"));
+        printAlignedRight(PSTR("Profiler: "), 180);
+        setPrintX(180);
+        print(profilerBytes());
+        println(PSTR(" bytes"));
+        toolbarAdd(PSTR("Chunks"), openChunks);
+        toolbarAdd(PSTR("Profiler"), screenProfiler);
         toolbarAdd(PSTR("<<"), startScreen);
     }
 
@@ -191,16 +596,25 @@ namespace admin {
     }
 
     void logCallback(int selected, int button) {
+        if (selected < 0 || selected >= numberOfInstances() || button < 0) {
+            goToScreen(screenMore);
+            return;
+        }
         switchContextToInstance(selected);
         if (button == 0) {
             if (!chunkForHandleExists(LOG_HANDLE))
-                createLogChunk(200);
+                createLogChunk(LOG_STEP);
             else
-                resizeChunk(LOG_HANDLE, chunkSize(LOG_HANDLE) + 200);
+                resizeChunk(LOG_HANDLE, chunkSize(LOG_HANDLE) + LOG_STEP);
         } else if (chunkForHandleExists(LOG_HANDLE)) {
-            resizeChunk(LOG_HANDLE, chunkSize(LOG_HANDLE) - 200);
-            if (logChunkIsEmpty())
+            // the last step frees the chunk instead of leaving an empty one
+            if (chunkSize(LOG_HANDLE) <= LOG_STEP)
                 deallocChunk(LOG_HANDLE);
+            else {
+                resizeChunk(LOG_HANDLE, chunkSize(LOG_HANDLE) - LOG_STEP);
+                if (logChunkIsEmpty())
+                    deallocChunk(LOG_HANDLE);
+            }
         }
         popContext();
     }
@@ -266,3 +680,21 @@ namespace admin {
         return digital && port == _alarmPort ? PSTR("Alarm") : 0;
     }
 }  // namespace admin
+
+// Called by the dashboard with the microseconds the monitor of an instance took
+void profilerRecord(int instance, unsigned long duration) {
+    admin::record(instance, duration);
+}
+
+int adminNumberOfMonitoreables() {
+    admin::checkIndex();
+    return admin::numberOfMonitoreables;
+}
+
+// instance of the index-th app with a monitor, -1 if there is none
+int adminMonitoreable(int index) {
+    admin::checkIndex();
+    if (index < 0 || index >= admin::numberOfMonitoreables)
+        return -1;
+    return admin::monitoreable(index);
+}
@@ -33,14 +33,19 @@ namespace aqua {
 
     void keyboardCallback(int ok) {
         if (ok) {
-            if (chunkForHandleExists(NAME_HANDLE))
+            // A name of the same length is rewritten in place, so renaming
+            // does not free and allocate a chunk (and leave a hole behind).
+            if (chunkForHandleExists(NAME_HANDLE) && chunkSize(NAME_HANDLE) != ramSourceLength() + 1)
                 deallocChunk(NAME_HANDLE);
+            if (!chunkForHandleExists(NAME_HANDLE))
+                allocChunk(NAME_HANDLE, ramSourceLength() + 1);
 
-            allocChunk(NAME_HANDLE, ramSourceLength() + 1);
-
+            // only the bytes that changed are written
             for (int i = 0; i < ramSourceLength(); i++)
-                pset(NAME_HANDLE, i, getRamSource(i));
-            pset(NAME_HANDLE, ramSourceLength(), 0);
+                if (pget(NAME_HANDLE, i) != getRamSource(i))
+                    pset(NAME_HANDLE, i, getRamSource(i));
+            if (pget(NAME_HANDLE, ramSourceLength()))
+                pset(NAME_HANDLE, ramSourceLength(), 0);
         }
         goToScreen(startScreen);
     }
@@ -24,11 +24,19 @@
 
 #include "AquaOS.h"
 
+#define BUTTON_DEBOUNCE 3
+
+int  pmRegisterInput(int port, int debounce);
+void pmReleaseInput(int port);
+int  pmInputLevel(int port);
+
 namespace button {
     void startScreen();
     void show();
 
     char port;
+    char pressed;
+    char debounced;  // the ports manager had a slot for the port
 
     // CALLBACKS
 
@@ -38,11 +46,22 @@ namespace button {
 
     void registerVars() {
         pregister(&port);
+        mregister(&pressed);
+        mregister(&debounced);
+    }
+
+    // Without a free slot the port is still read, once per slice, but
+    // without debouncing, and the screen says so
+    void registerPort() {
+        debounced = pmRegisterInput(port, BUTTON_DEBOUNCE) != -1;
+        if (!debounced)
+            pinMode(port, INPUT);
     }
 
     void whenPowered() {
+        pressed = 0;
         if (port)
-            pinMode(port, INPUT);
+            registerPort();
     }
 
     int configured() {
@@ -65,17 +84,21 @@ namespace button {
         if (!port)
             return 0;
         if (kind == 0)
-            return digitalRead(port);
-        return !digitalRead(port);
+            return pressed;
+        return !pressed;
     }
 
     int state() {
         if (!configured())
             return STATE_NOT_CONFIGURED;
-        return pmDigitalRead(port);
+        return pressed;
     }
 
+    // The ports manager debounces the port, conditions and the screen use
+    // its stable level so they only change when the button does
     void timeSlice(int fg, frequency frequency) {
+        if (configured())
+            pressed = pmInputLevel(port);
         if (fg && currentScreenIs(startScreen))
             show();
     }
@@ -83,9 +106,11 @@ namespace button {
     // GUI
 
     void setPort(int selectedPort) {
-        if (selectedPort) {
+        if (selectedPort && selectedPort != port) {
+            if (port)
+                pmReleaseInput(port);
             port = selectedPort;
-            pinMode(port, INPUT);
+            registerPort();
         }
         goToScreen(startScreen);
     }
@@ -108,10 +133,12 @@ namespace button {
         if (!configured())
             return;
         cleanRestOfLine();
-        if (pmDigitalRead(port))
+        if (pressed)
             print(PSTR("Pressed"));
         else
             print(PSTR("Not pressed"));
+        if (!debounced)
+            print(PSTR(" (not debounced, too many inputs)"));
     }
 
     void startScreen() {
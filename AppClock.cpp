@@ -24,6 +24,12 @@
 
 #include "AquaOS.h"
 
+// gaps longer than this are a clock change, not a late slice
+#define MAX_CATCH_UP 300
+
+// year, month, day, hours, mins, secs
+#define CLOCK_FIELDS 6
+
 namespace cc {
 
     void          startScreen();
@@ -35,27 +41,124 @@ namespace cc {
 
     int ccToolbarSet = 0;
 
+    // What the clocks show and where each field starts, so a new second only
+    // repaints the fields that changed
+    int clockFields[CLOCK_FIELDS];
+    int clockFieldX[CLOCK_FIELDS];
+    int barFields[CLOCK_FIELDS];
+    int barFieldX[CLOCK_FIELDS];
+
+    // The time of day is decomposed once per second, every rule then compares
+    // against it. elapsed counts the seconds since the previous evaluated one,
+    // so events that fell in a gap (an overrun slice) still fire, once.
+    unsigned long cachedEpoch = -1;
+    long          secondOfDay;
+    unsigned int  elapsed;
+
+    void updateClock() {
+        unsigned long epoch = clockEpoch();
+        if (epoch == cachedEpoch)
+            return;
+        if (cachedEpoch != (unsigned long)-1 && epoch > cachedEpoch && epoch - cachedEpoch <= MAX_CATCH_UP)
+            elapsed = epoch - cachedEpoch;
+        else
+            elapsed = 1;
+        cachedEpoch = epoch;
+        secondOfDay = clockHours() * 3600L + clockMins() * 60 + clockSecs();
+    }
+
+    // the time of day happened in the last elapsed seconds
+    int due(long time) {
+        return (secondOfDay - time + 86400L) % 86400L < elapsed;
+    }
+
     void print2Digits(int number, const char* suffix) {
         print(number, 2);
         print(suffix);
     }
 
+    void readClock(int* fields) {
+        fields[0] = clockYear();
+        fields[1] = clockMonth();
+        fields[2] = clockDay();
+        fields[3] = clockHours();
+        fields[4] = clockMins();
+        fields[5] = clockSecs();
+    }
+
+    // the first field from the given one on that differs from what is shown,
+    // CLOCK_FIELDS if none
+    int firstChange(int from, int* shown, int* now) {
+        int i = from;
+        while (i < CLOCK_FIELDS && shown[i] == now[i])
+            i++;
+        return i;
+    }
+
+    int twoDigitsWidth(int number) {
+        return intWidth(number / 10) + intWidth(number % 10);
+    }
+
+    // width of a field as printFields prints it, suffix included
+    int fieldWidth(int i, int value) {
+        if (i == 0)
+            return intWidth(value + 2000) + stringWidth(PSTR("-"));
+        if (i == 1)
+            return twoDigitsWidth(value) + stringWidth(PSTR("-"));
+        if (i == 2)
+            return twoDigitsWidth(value) + stringWidth(PSTR("  "));
+        if (i == 5)
+            return twoDigitsWidth(value);
+        return twoDigitsWidth(value) + stringWidth(PSTR(":"));
+    }
+
+    // prints the fields from the given one on at x, remembering where they start
+    void printFields(int from, int to, int x, int* shown, int* xs, int* now) {
+        setPrintX(x);
+        for (int i = from; i < to; i++) {
+            xs[i] = x;
+            x += fieldWidth(i, now[i]);
+            shown[i] = now[i];
+            if (i == 0) {
+                print(now[i] + 2000);
+                print(PSTR("-"));
+            } else if (i == 1)
+                print2Digits(now[i], PSTR("-"));
+            else if (i == 2)
+                print2Digits(now[i], PSTR("  "));
+            else if (i == 5)
+                print2Digits(now[i], PSTR(""));
+            else
+                print2Digits(now[i], PSTR(":"));
+        }
+    }
+
     void ccDrawClock() {
+        int now[CLOCK_FIELDS];
+        readClock(now);
         setBigFont();
         setColor(colorDarkGray);
         fillRect(85, 68, 160, 22);
         setColor(colorBlack);
         drawRect(85, 68, 160, 22);
         setColor(colorWhite);
-        setPrintX(95);
         setPrintY(70);
-        print(clockYear() + 2000);
-        print(PSTR("-"));
-        print2Digits(clockMonth(), PSTR("-"));
-        print2Digits(clockDay(), PSTR("  "));
-        print2Digits(clockHours(), PSTR(":"));
-        print2Digits(clockMins(), PSTR(":"));
-        print2Digits(clockSecs(), PSTR(""));
+        printFields(0, CLOCK_FIELDS, 95, clockFields, clockFieldX, now);
+    }
+
+    // repaints the box from the first field that changed
+    void ccUpdateClock() {
+        int now[CLOCK_FIELDS];
+        readClock(now);
+        int from = firstChange(0, clockFields, now);
+        if (from == CLOCK_FIELDS)
+            return;
+        setBigFont();
+        setColor(colorDarkGray);
+        fillRect(clockFieldX[from], 69, 85 + 159 - clockFieldX[from], 20);
+        setColor(colorWhite);
+        setPrintY(70);
+        printFields(from, CLOCK_FIELDS, clockFieldX[from], clockFields, clockFieldX, now);
     }
 
     void setToolbarSet(int param) {
@@ -87,7 +190,8 @@ namespace cc {
     }
 
     int evalCondition(int kind, uint16_t* params) {
-        return 0 == clockSecs() && params[0] == clockHours() && params[1] == clockMins();
+        updateClock();
+        return due(params[0] * 3600L + params[1] * 60);
     }
 
     void addUnit(int addYear, int addMonth, int addDay, int addHours, int addMins, int addSecs) {
@@ -98,6 +202,8 @@ namespace cc {
         setClockSecs(correctValue(clockSecs() + addSecs, 0, 59));
         int daysInMonth = clockMonth() == 2 ? 28 + (clockYear() % 4 == 0 ? 1 : 0) : 31 - (clockMonth() - 1) % 7 % 2;
         setClockDay(correctValue(clockDay() + addDay, 1, daysInMonth));
+        // the jump is not a gap to catch up, for cc and for the timer
+        cachedEpoch = -1;
         ccDrawClock();
     }
 
@@ -178,33 +284,47 @@ namespace cc {
     }
 
     void timeSlice(int fg, frequency frequency) {
-        // The time, top right
+        // The time, top right. Only hours, mins and secs are shown, and only
+        // from the first one that changed (no flickering). The whole time is
+        // repainted every minute, in case something painted over the bar.
+        int now[CLOCK_FIELDS];
+        readClock(now);
+        int from = first ? 3 : firstChange(3, barFields, now);
+        if (from == CLOCK_FIELDS)
+            return;
+        if (now[5] == 0)
+            from = 3;
+        first = 0;
         setBigFont();
-        setPrintX(250);
         setMaxPrintX(319);
         setPrintY(0);
         setColor(colorWhite);
-        // no flickering
-        if (clockSecs() > 0 && !first) {
-            int x = 250;
-            x += intWidth(clockHours() / 10) + intWidth(clockHours() % 10) + stringWidth(PSTR(":"));
-            x += intWidth(clockMins() / 10) + intWidth(clockMins() % 10) + stringWidth(PSTR(":"));
-            setPrintX(x);
-            fillRect(x, 0, 20, menuBarHeight);
-            setColor(colorBlack);
-        } else {
-            fillRect(250, 0, horizontalResolution - 250, menuBarHeight);
-            setColor(colorBlack);
-            print2Digits(clockHours(), PSTR(":"));
-            print2Digits(clockMins(), PSTR(":"));
-        }
-        first = 0;
-        print2Digits(clockSecs(), PSTR(""));
+        int x = from == 3 ? 250 : barFieldX[from];
+        fillRect(x, 0, horizontalResolution - x, menuBarHeight);
+        setColor(colorBlack);
+        printFields(from, CLOCK_FIELDS, x, barFields, barFieldX, now);
         if (!currentScreenIs(startScreen) && !currentScreenIs(screenHour) && !currentScreenIs(screenMin) &&
             !currentScreenIs(screenSec) && !currentScreenIs(screenYear) && !currentScreenIs(screenMonth) &&
             !currentScreenIs(screenDay))
             return;
-        ccDrawClock();
+        ccUpdateClock();
         setMaxPrintX(319 - margin);
     }
 }  // namespace cc
+
+// The timer evaluates against the same cache, so a clock change made here
+// is not taken by the timer as seconds to catch up
+int ccClockDue(long time) {
+    cc::updateClock();
+    return cc::due(time);
+}
+
+unsigned long ccClockEpoch() {
+    cc::updateClock();
+    return cc::cachedEpoch;
+}
+
+unsigned int ccClockElapsed() {
+    cc::updateClock();
+    return cc::elapsed;
+}
@@ -53,3 +53,8 @@ namespace debug {
     }
 
 }  // namespace debug
+
+// first handle the debug app has not used yet
+int debugHandleLimit() {
+    return debug::c;
+}
@@ -24,38 +24,64 @@
 
 #include "AquaOS.h"
 
+#define TILES 4
+
+int  adminNumberOfMonitoreables();
+int  adminMonitoreable(int index);
+void profilerRecord(int instance, unsigned long duration);
+
 namespace monitor {
 
     char page = 0;
     char first = 0;
     void startScreen(void);
 
+    // PERSISTANT VARS
+    // seconds between repaints of each tile
+    char interval[TILES];
+
+    // VOLATILE VARS
+    char countdown[TILES];
+    char editedTile;
+    // next step of the frame being painted: 0 is the background, then one
+    // step per tile, TILES + 1 once the frame is complete
+    char step = TILES + 1;
+
     int cardinality() {
         return APP_CARDINALITY_MAX_ONE;
     }
 
+    void registerVars() {
+        for (int i = 0; i < TILES; i++)
+            pregister(&interval[i]);
+    }
+
+    void whenCreated() {
+        for (int i = 0; i < TILES; i++)
+            interval[i] = 1;
+    }
+
     int numberOfMonitoreableApps() {
-        int r = 0;
-        for (int i = 0; i < numberOfInstances(); i++)
-            if (hasMonitorForInstance(i))
-                r++;
-        return r;
+        return adminNumberOfMonitoreables();
     }
 
     int monitoreable(int index) {
-        for (int i = 0; i < numberOfInstances(); i++) {
-            if (hasMonitorForInstance(i)) {
-                if (index == 0)
-                    return i;
-                index--;
-            }
+        return adminMonitoreable(index);
+    }
+
+    // a tile is repainted every interval seconds, or when the frame is new
+    int tileDue(int tile) {
+        if (first || countdown[tile] <= 1) {
+            countdown[tile] = interval[tile];
+            return 1;
         }
-        return -1;
+        countdown[tile]--;
+        return 0;
     }
 
     void drawInstance(int i, int x, int y, int w, int h, int n, int bg) {
         int instance = monitoreable(i);
-        if (instance == -1)
+        if (instance == -1 || !tileDue(i - page))
             return;
         int dashColor = colorFromRGB(14 * 255 / 100, 21 * 255 / 100, 35 * 255 / 100);
         setColor(dashColor);
@@ -77,35 +103,50 @@ namespace monitor {
             print(nameForInstance(instance));
         }
         setColor(dashColor);
+        unsigned long start = micros();
         callMonitor(instance, x, y + 16, w, h - 16, first);
+        profilerRecord(instance, micros() - start);
     }
 
-    void draw() {
+    // Paints the next step of the frame
+    void drawStep() {
         int m = menuBarHeight + 1;
-        setColor(colorMonitor);
-        if (first)
+        if (step == 0 && first) {
+            setColor(colorMonitor);
             fillRect(0, m, 320, verticalResolution - menuBarHeight - toolbarHeight);
-        if (listenToTouchesOnScreen())
-            return;
-        drawInstance(page, 0, m, 160, 90, 5, 0);
-        if (listenToTouchesOnScreen())
-            return;
-        drawInstance(page + 1, 160, m, 160, 90, 4, 1);
-        if (listenToTouchesOnScreen())
-            return;
-        drawInstance(page + 2, 0, m + 90, 160, 89, 4, 1);
-        if (listenToTouchesOnScreen())
-            return;
-        drawInstance(page + 3, 160, m + 90, 160, 89, 4, 0);
-        first = 0;
+        }
+        if (step == 1)
+            drawInstance(page, 0, m, 160, 90, 5, 0);
+        if (step == 2)
+            drawInstance(page + 1, 160, m, 160, 90, 4, 1);
+        if (step == 3)
+            drawInstance(page + 2, 0, m + 90, 160, 89, 4, 1);
+        if (step == 4)
+            drawInstance(page + 3, 160, m + 90, 160, 89, 4, 0);
+        if (step <= TILES)
+            step++;
+        if (step > TILES)
+            first = 0;
+    }
+
+    // Paints until the frame is complete or a touch is pending. A frame that
+    // is interrupted keeps its progress and is resumed on the next slice.
+    void draw() {
+        while (step <= TILES && !listenToTouchesOnScreen())
+            drawStep();
     }
 
     void timeSlice(int fg, frequency frequency) {
-        // We drive every 5 seconds, only if the current screen is ours (if
-        // not we would draw on top of all the other apps)
-        if (!fg || frequency.type != second)
+        // Only if the current screen is ours (if not we would draw on top of
+        // all the other apps). A new frame starts every second, and every
+        // slice paints one step of it so touches wait at most for one tile.
+        if (!fg)
             return;
-        draw();
+        // The background is only painted by the first frame.
+        if (step > TILES && frequency.type == second)
+            step = 1;
+        if (step <= TILES && !listenToTouchesOnScreen())
+            drawStep();
     }
 
     void left(int param) {
@@ -119,12 +160,51 @@ namespace monitor {
         goToScreen(startScreen);
     }
 
+    void intervalEntered(int success, float value) {
+        if (success)
+            interval[(int)editedTile] = (int)value;
+        goToScreen(startScreen);
+    }
+
+    void tileSelected(int selected, int button) {
+        if (selected >= 0 && selected < TILES && button >= 0) {
+            editedTile = selected;
+            showNumPad(PSTR("Repaint the tile every how many seconds?"), interval[selected], 1, 60, intervalEntered, 0);
+        } else
+            goToScreen(startScreen);
+    }
+
+    const char* tileLabels(int i) {
+        if (i == 0)
+            return PSTR("Top left");
+        if (i == 1)
+            return PSTR("Top right");
+        if (i == 2)
+            return PSTR("Bottom left");
+        if (i == 3)
+            return PSTR("Bottom right");
+        return 0;
+    }
+
+    void refresh(int param) {
+        showSelectDialog(PSTR("Select"), 2, tileLabels, tileSelected, 0,
+                         PSTR("Select a tile and press 'Select' to set how often it is repainted."));
+    }
+
     void startScreen() {
         toolbarAdd(standard, page > 0, MINI_ICON_LEFT, left);
         toolbarAdd(standard, page + 4 < numberOfMonitoreableApps(), MINI_ICON_RIGHT, right);
+        toolbarAdd(PSTR("Refresh"), refresh);
         toolbarAddHome();
         first = 1;
+        step = 0;
         draw();
     }
 
 }  // namespace monitor
+
+// True while the dashboard paints a new frame over cleared tiles. Monitors
+// may skip repainting a value that did not change when it is false.
+int monitorFullRedraw() {
+    return monitor::first;
+}
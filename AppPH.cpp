@@ -24,56 +24,298 @@
 
 #include "AquaOS.h"
 
+int pmAnalogRead(int port);
+int monitorFullRedraw();
+
+#define PH_MAX_WINDOW 8
+#define PH_SHIFT 10
+
+#define PH_FILTER_MEAN 0
+#define PH_FILTER_MEDIAN 1
+#define PH_FILTER_EXPONENTIAL 2
+
+/*
+ CALIBRATION CHUNK
+
+ BYTE 0: number of points
+ then per point, sorted by PH:
+ BYTES 0, 1: PH in hundredths
+ BYTES 2, 3: analog reading of its solution, 0 if not read yet
+ */
+
+#define PH_CALIBRATION_HANDLE 50
+#define PH_MAX_POINTS 5
+#define PH_FIELD_PH 0
+#define PH_FIELD_ANALOG 1
+
+// the filtered value (12 bits) is bucketed by its high nibble
+#define PH_BUCKETS 16
+#define PH_BUCKET_SHIFT 8
+
 namespace ph {
     // PERSISTANT VARS
-    char  port;
+    char port;
+    // the two point calibration of older versions, only read to move it
+    // into the calibration chunk
     int   analogValueFor40, analogValueFor70;
     float real40, real70;
+    char  window;
+    char  filter;
 
     // VOLATILE VARS
-    float last10[10];
+    // one sample per slice, filtered keeps the result in 1/4 of an analog unit
+    int  samples[PH_MAX_WINDOW];
+    char head;
+    char filled;
+    int  sum;
+    int  filtered;
+    // The calibrated points split the analog range in segments. On segment s,
+    // PH in hundredths is ((filtered * slope[s]) >> PH_SHIFT) + offset[s].
+    // Segment s ends at breakpoint[s], bucketSegment gives the first segment
+    // that a bucket of filtered values can fall in.
+    char          segments;
+    long          slope[PH_MAX_POINTS - 1];
+    long          offset[PH_MAX_POINTS - 1];
+    int           breakpoint[PH_MAX_POINTS - 1];
+    unsigned char bucketSegment[PH_BUCKETS];
+    // PH of the filtered value, what rules, monitor and screens read
+    int current;
+    int shown;  // PH on the monitor tile
 
     void startScreen();
     void screenConfigure();
     void screenPoints();
     void screenSolution();
+    void screenFilter();
 
     // IMPLEMENTATION
 
     void registerVars() {
-        // mregister(last10, 10);
         pregister(&port);
         pregister(&analogValueFor40);
         pregister(&analogValueFor70);
         pregister(&real40);
         pregister(&real70);
+        pregister(&window);
+        pregister(&filter);
+        for (int i = 0; i < PH_MAX_WINDOW; i++)
+            mregister(&samples[i]);
+        mregister(&head);
+        mregister(&filled);
+        mregister(&sum);
+        mregister(&filtered);
+        mregister(&segments);
+        for (int i = 0; i < PH_MAX_POINTS - 1; i++) {
+            mregister(&slope[i]);
+            mregister(&offset[i]);
+            mregister(&breakpoint[i]);
+        }
+        for (int i = 0; i < PH_BUCKETS; i++)
+            mregister(&bucketSegment[i]);
+        mregister(&current);
+        mregister(&shown);
+    }
+
+    // CALIBRATION TABLE
+
+    int numberOfPoints() {
+        if (!chunkForHandleExists(PH_CALIBRATION_HANDLE))
+            return 0;
+        return pget(PH_CALIBRATION_HANDLE, 0);
+    }
+
+    int point(int i, int field) {
+        int p = 1 + i * 4 + field * 2;
+        return (pget(PH_CALIBRATION_HANDLE, p) & 0xFF) | (pget(PH_CALIBRATION_HANDLE, p + 1) & 0xFF) << 8;
+    }
+
+    void setPoint(int i, int field, int value) {
+        int p = 1 + i * 4 + field * 2;
+        pset(PH_CALIBRATION_HANDLE, p, value & 0xFF);
+        pset(PH_CALIBRATION_HANDLE, p + 1, value >> 8);
+    }
+
+    void allocPoints() {
+        if (chunkForHandleExists(PH_CALIBRATION_HANDLE))
+            return;
+        allocChunk(PH_CALIBRATION_HANDLE, 1 + PH_MAX_POINTS * 4);
+        pset(PH_CALIBRATION_HANDLE, 0, 0);
+    }
+
+    void setNumberOfPoints(int n) {
+        allocPoints();
+        pset(PH_CALIBRATION_HANDLE, 0, n);
+    }
+
+    // keeps the points sorted by PH
+    void addPoint(int phValue, int analog) {
+        allocPoints();
+        int n = numberOfPoints();
+        int i = n;
+        for (; i > 0 && point(i - 1, PH_FIELD_PH) > phValue; i--) {
+            setPoint(i, PH_FIELD_PH, point(i - 1, PH_FIELD_PH));
+            setPoint(i, PH_FIELD_ANALOG, point(i - 1, PH_FIELD_ANALOG));
+        }
+        setPoint(i, PH_FIELD_PH, phValue);
+        setPoint(i, PH_FIELD_ANALOG, analog);
+        setNumberOfPoints(n + 1);
+    }
+
+    // PH in hundredths of a filtered value
+    int convert(int value) {
+        int s = bucketSegment[value >> PH_BUCKET_SHIFT];
+        while (s < segments - 1 && value >= breakpoint[s])
+            s++;
+        long v = ((value * slope[s]) >> PH_SHIFT) + offset[s];
+        if (v < 0)
+            return 0;
+        if (v > 1400)
+            return 1400;
+        return v;
+    }
+
+    // Precomputes the segments between the points that were read, so
+    // converting is a bucket lookup plus one multiply and shift, without
+    // float math. With less than two read points the probe reads 7.0.
+    void calibrate() {
+        int x[PH_MAX_POINTS], y[PH_MAX_POINTS];
+        int n = 0;
+        for (int i = 0; i < numberOfPoints(); i++) {
+            int analog = point(i, PH_FIELD_ANALOG);
+            if (!analog)
+                continue;
+            // a second point with the same reading is ignored
+            int lo = 0, hi = n;
+            while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (x[mid] < analog)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if (lo < n && x[lo] == analog)
+                continue;
+            for (int j = n; j > lo; j--) {
+                x[j] = x[j - 1];
+                y[j] = y[j - 1];
+            }
+            x[lo] = analog;
+            y[lo] = point(i, PH_FIELD_PH);
+            n++;
+        }
+        if (n < 2) {
+            segments = 1;
+            slope[0] = 0;
+            offset[0] = 700;
+        } else {
+            segments = n - 1;
+            for (int s = 0; s < segments; s++) {
+                slope[s] = ((long)(y[s + 1] - y[s]) << PH_SHIFT) / ((x[s + 1] - x[s]) * 4);
+                offset[s] = y[s] - (((long)x[s] * 4 * slope[s]) >> PH_SHIFT);
+                breakpoint[s] = x[s + 1] * 4;
+            }
+        }
+        int s = 0;
+        for (int b = 0; b < PH_BUCKETS; b++) {
+            while (s < segments - 1 && (b << PH_BUCKET_SHIFT) >= breakpoint[s])
+                s++;
+            bucketSegment[b] = s;
+        }
+        current = convert(filtered);
     }
 
     void whenCreated() {
-        port = analogValueFor40 = analogValueFor70 = 0;
-        real40 = 4.1;
-        real70 = 7.65;
-        //
         port = 13;
-        analogValueFor70 = 500;
-        analogValueFor40 = 200;
+        window = 4;
+        filter = PH_FILTER_MEAN;
+        analogValueFor40 = analogValueFor70 = 0;
+        setNumberOfPoints(0);
+        addPoint(410, 200);
+        addPoint(765, 500);
+        calibrate();
+    }
+
+    void resetSamples() {
+        for (int i = 0; i < PH_MAX_WINDOW; i++)
+            samples[i] = 0;
+        head = filled = 0;
+        sum = filtered = 0;
+    }
+
+    // Instances calibrated before the chunk existed keep their two points
+    void migrateCalibration() {
+        if (chunkForHandleExists(PH_CALIBRATION_HANDLE) || !analogValueFor40 || !analogValueFor70)
+            return;
+        addPoint((int)(real40 * 100 + 0.5), analogValueFor40);
+        addPoint((int)(real70 * 100 + 0.5), analogValueFor70);
     }
 
     void whenPowered() {
-        for (int i = 0; i < 10; i++)
-            last10[i] = 2 + i * 3;
+        migrateCalibration();
+        resetSamples();
+        calibrate();
+    }
+
+    // SAMPLING
+    int median() {
+        int sorted[PH_MAX_WINDOW];
+        for (int i = 0; i < filled; i++) {
+            int j = i;
+            for (; j > 0 && sorted[j - 1] > samples[i]; j--)
+                sorted[j] = sorted[j - 1];
+            sorted[j] = samples[i];
+        }
+        return sorted[filled / 2];
+    }
+
+    int windowSize() {
+        return window < 1 || window > PH_MAX_WINDOW ? 1 : window;
+    }
+
+    // Called once per slice. The window is oversampled and decimated to two
+    // extra bits, so readers get the filtered value without a conversion.
+    void sample() {
+        int raw = pmAnalogRead(port);
+        sum += raw - samples[(int)head];
+        samples[(int)head] = raw;
+        head = (head + 1) % windowSize();
+        if (filled < windowSize())
+            filled++;
+        if (filter == PH_FILTER_MEDIAN)
+            filtered = median() * 4;
+        else if (filter == PH_FILTER_EXPONENTIAL)
+            filtered = filled == 1 ? raw * 4 : filtered + (raw * 4 - filtered) / 4;
+        else
+            filtered = (long)sum * 4 / filled;
+        current = convert(filtered);
+    }
+
+    int analogValue() {
+        if (!filled)
+            sample();
+        return (filtered + 2) / 4;
     }
 
     // FUNCTIONS
+    int calibrated() {
+        return segments > 1 || slope[0];
+    }
+
     int configured() {
-        return port * analogValueFor70 * analogValueFor40;
+        return port && calibrated();
+    }
+
+    // PH in hundredths, converted once per sample
+    int ph() {
+        if (!filled)
+            sample();
+        return current;
     }
 
-    float ph() {
-        if (analogValueFor40 * analogValueFor70 == 0 || analogValueFor40 == analogValueFor70)
-            return 7.0;
-        return (analogRead(port) - analogValueFor40) * (real70 - real40) / (analogValueFor70 - analogValueFor40) +
-               real40;
+    void printPH(int v) {
+        print(v / 100);
+        print(PSTR("."));
+        print(v % 100, 2);
     }
 
     // CONDITIONS
@@ -86,10 +328,12 @@ namespace ph {
     }
 
     int evalCondition(int kind, uint16_t* params) {
+        if (!configured())
+            return 0;
         if (kind == 0)
-            return ph() < params[0] / 10;
+            return ph() < params[0] * 10;
         if (kind == 1)
-            return ph() > params[0] / 10;
+            return ph() > params[0] * 10;
         return 0;
     }
 
@@ -107,12 +351,15 @@ namespace ph {
 
     // MONITOR
     void monitor(int x, int y, int w, int h) {
+        if (!monitorFullRedraw() && shown == ph())
+            return;
+        shown = ph();
         fillRect(x, y, w, h);
         if (configured()) {
             setColor(colorWhite);
             setPrintX(x + 69);
             setPrintY(y + 30);
-            print(ph());
+            printPH(shown);
         }
     }
 
@@ -126,38 +373,31 @@ namespace ph {
     }
 
     // SHOW STATE
-    void showCalibrationPoints() {
-        print(PSTR("> Low calibration point is: "));
-        println(real40);
-        println();
-        print(PSTR("> High calibration point is: "));
-        println(real70);
-        println();
-    }
-
-    void showAnalogValues() {
-        if (analogValueFor40) {
-            print(PSTR("> Solution reading for low point is: "));
-            println(analogValueFor40);
-            println();
-        } else {
-            pushColor();
-            setColor(colorDarkGray);
-            println(PSTR("> No solution reading for low point."));
-            println();
-            popColor();
-        }
-        if (analogValueFor70) {
-            print(PSTR("> Solution reading for high point is: "));
-            println(analogValueFor70);
-            println();
-        } else {
+    void showPoints() {
+        int n = numberOfPoints();
+        if (!n) {
             pushColor();
             setColor(colorDarkGray);
-            println(PSTR("> No solution reading for high point."));
+            println(PSTR("> No calibration points."));
             popColor();
             println();
         }
+        for (int i = 0; i < n; i++) {
+            print(PSTR("> "));
+            print(i + 1);
+            print(PSTR(": PH "));
+            printPH(point(i, PH_FIELD_PH));
+            if (point(i, PH_FIELD_ANALOG)) {
+                print(PSTR(", solution reading is "));
+                println(point(i, PH_FIELD_ANALOG));
+            } else {
+                pushColor();
+                setColor(colorDarkGray);
+                println(PSTR(", no solution reading."));
+                popColor();
+            }
+        }
+        println();
     }
 
     void showState() {
@@ -170,8 +410,7 @@ namespace ph {
             println(PSTR("No port set."));
             println();
         }
-        showCalibrationPoints();
-        showAnalogValues();
+        showPoints();
     }
 
     // DIALOGS
@@ -180,8 +419,10 @@ namespace ph {
     }
 
     void setPortCont(int p) {
-        if (p)
+        if (p) {
             port = p;
+            resetSamples();
+        }
         goToScreen(screenConfigure);
     }
 
@@ -189,70 +430,121 @@ namespace ph {
         showAnalogPortDialog(port, setPortCont);
     }
 
-    void setSolutionHigh(int param) {
-        analogValueFor70 = analogRead(port);
-        message(PSTR("High point calibrated."), screenSolution, DRAWSCREEN_CLEAR_MIDDLE);
+    const char* pointLabels(int i) {
+        if (i >= numberOfPoints())
+            return 0;
+        if (i == 0)
+            return PSTR("Point 1");
+        if (i == 1)
+            return PSTR("Point 2");
+        if (i == 2)
+            return PSTR("Point 3");
+        if (i == 3)
+            return PSTR("Point 4");
+        if (i == 4)
+            return PSTR("Point 5");
+        return 0;
+    }
+
+    void readSolutionCallback(int selected, int button) {
+        if (selected >= 0 && selected < numberOfPoints() && button >= 0) {
+            setPoint(selected, PH_FIELD_ANALOG, analogValue());
+            calibrate();
+            message(PSTR("Point calibrated."), screenSolution, DRAWSCREEN_CLEAR_MIDDLE);
+        } else
+            goToScreen(screenSolution);
     }
 
-    void setSolutionLow(int param) {
-        analogValueFor40 = analogRead(port);
-        message(PSTR("Low point calibrated."), screenSolution, DRAWSCREEN_CLEAR_MIDDLE);
+    void readSolution(int param) {
+        showSelectDialog(PSTR("Read"), 2, pointLabels, readSolutionCallback, 0,
+                         PSTR("Put the probe in the calibration solution of a point, select the point and press "
+                              "'Read'."));
     }
 
-    void setHighPointCont(int success, float v) {
+    void addPointCont(int success, float v) {
         if (success) {
-            real70 = v;
-            message(PSTR("Set high point"), screenPoints);
+            addPoint((int)(v * 100 + 0.5), 0);
+            calibrate();
+            message(PSTR("Point added"), screenPoints);
         } else
             goToScreen(screenPoints);
     }
 
-    void setHighPoint(int param) {
-        showNumPad(PSTR("Select the high PH point (usually 7.1 or similar)."), 4.1, real40, 13.0, setHighPointCont, 1);
+    void addPointDialog(int param) {
+        showNumPad(PSTR("Enter the PH of the calibration solution (usually 4.0, 7.0 or 10.0)."), 7.0, 1.0, 13.0,
+                   addPointCont, 2);
     }
 
-    void setLowPointCont(int success, float v) {
+    void clearPoints(int param) {
+        setNumberOfPoints(0);
+        calibrate();
+        goToScreen(screenPoints);
+    }
+
+    void setWindowCont(int success, float v) {
         if (success) {
-            real40 = v;
-            message(PSTR("Set low point"), screenPoints);
-        } else
-            goToScreen(screenPoints);
+            window = (int)v;
+            resetSamples();
+        }
+        goToScreen(screenFilter);
     }
 
-    void setLowPoint(int param) {
-        showNumPad(PSTR("Select the low PH point (usually 4.1 or similar)."), 4.1, 2.0, real70, setLowPointCont, 1);
+    void setWindow(int param) {
+        showNumPad(PSTR("How many samples are filtered (1-8)?"), window, 1, PH_MAX_WINDOW, setWindowCont, 0);
+    }
+
+    void nextFilter(int param) {
+        filter = (filter + 1) % 3;
+        resetSamples();
+        goToScreen(screenFilter);
     }
 
     // NAVIGATION SCREENS
+    void screenFilter() {
+        println(PSTR("The probe is sampled once per time slice and the last samples are filtered to remove spikes."));
+        println();
+        print(PSTR("> Samples in the window: "));
+        println(window);
+        println();
+        print(PSTR("> Filter: "));
+        if (filter == PH_FILTER_MEDIAN)
+            println(PSTR("Median"));
+        else if (filter == PH_FILTER_EXPONENTIAL)
+            println(PSTR("Exponential"));
+        else
+            println(PSTR("Average"));
+        toolbarAdd(PSTR("Window"), setWindow);
+        toolbarAdd(PSTR("Mode"), nextFilter);
+        toolbarAdd(mini, 1, PSTR("<<"), screenConfigure);
+    }
+
     void screenSolution() {
-        println(PSTR(
-            "You should put the probe in the low PH calibration solution and in the high PH calibration solution."));
+        println(PSTR("Put the probe in the calibration solution of each point and read it. At least two points have "
+                     "to be read."));
         println();
-        showAnalogValues();
-        toolbarAdd(PSTR("Low"), setSolutionLow);
-        toolbarAdd(PSTR("High"), setSolutionHigh);
+        showPoints();
+        toolbarAdd(standard, numberOfPoints() > 0, PSTR("Read"), readSolution);
         toolbarAdd(mini, 1, PSTR("<<"), screenConfigure);
     }
 
     void screenPoints() {
-        println(
-            PSTR("To calibrate the probe, you should set the calibration points, that is, the PH of the calibration "
-                 "solutions. Normally, the low calibration point is around 4.0, and the high about 7.0."));
+        println(PSTR("To calibrate the probe, you should add the calibration points, that is, the PH of up to five "
+                     "calibration solutions. Points around the PH of the tank give the best readings."));
         println();
-        showCalibrationPoints();
-        toolbarAdd(PSTR("Low"), setLowPoint);
-        toolbarAdd(PSTR("High"), setHighPoint);
+        showPoints();
+        toolbarAdd(standard, numberOfPoints() < PH_MAX_POINTS, PSTR("Add"), addPointDialog);
+        toolbarAdd(PSTR("Clear"), clearPoints);
         toolbarAdd(mini, 1, PSTR("<<"), screenConfigure);
     }
 
     int state() {
         if (!configured())
             return STATE_NOT_CONFIGURED;
-        return ph();
+        return ph() / 100;
     }
 
     void showPH() {
-        if (!port || !analogValueFor70 || !analogValueFor40) {
+        if (!configured()) {
             println(
                 PSTR("The app is not calibrated. Press Configure to set the port, the calibration points and calibrate "
                      "using calibration solutions."));
@@ -264,7 +556,7 @@ namespace ph {
         setPrintY(100);
         print(PSTR("PH: "));
         cleanRestOfLine();
-        print(ph());
+        printPH(ph());
     }
 
     void screenConfigure() {
@@ -272,11 +564,14 @@ namespace ph {
         toolbarAdd(PSTR("| Port"), setPort);
         toolbarAdd(PSTR("| Points"), screenPoints);
         toolbarAdd(standard, port, PSTR("| Solution"), screenSolution);
+        toolbarAdd(PSTR("| Filter"), screenFilter);
         toolbarAdd(mini, 1, PSTR("<<"), startScreen);
     }
 
     // TIME SLICE
     void timeSlice(int fg, frequency frequency) {
+        if (port)
+            sample();
         if (fg && currentScreenIs(startScreen) && configured())
             showPH();
     }
@@ -291,3 +586,7 @@ namespace ph {
     }
 
 }  // namespace ph
+
+int phCalibrationHandle() {
+    return PH_CALIBRATION_HANDLE;
+}
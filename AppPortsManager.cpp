@@ -34,25 +34,106 @@
 
  FIRST DIGITALS, THEN ANALOGS
 
- DIGITAL:
+ Every port owns a whole nibble (digital) or a whole byte (analog), so a port
+ is read and written with a single masked access instead of bit by bit.
+
+ DIGITAL (two ports per byte, even port in the low nibble):
  BIT 0: touched
  BIT 1: read pulse
  BIT 2: configured
  BIT 3: 0 LOW, 1 HIGH
 
- ANALOG:
+ ANALOG (one port per byte):
  BIT 0: touched
  BIT 1: read pulse
  BIT 2: configured
  BIT 3, 4, 5, 6, 7 => Value 0 -> 31
 
- => bits: 4 * 54 + 8 x 16 = 43 bytes
+ => bytes: 54 / 2 + 16 = 43 bytes
  */
 
-#define PORT_STATE_SIZE 43
+#define DIGITAL_PORTS 54
+#define ANALOG_PORTS 16
+#define ANALOG_OFFSET (DIGITAL_PORTS / 2)
+#define PORT_STATE_SIZE (ANALOG_OFFSET + ANALOG_PORTS)
+
+#define PORT_TOUCHED 0x01
+#define PORT_ACCESSED 0x02
+#define PORT_CONFIGURED 0x04
+#define PORT_VALUE_SHIFT 3
+
+// touched bits of both digital ports sharing a byte
+#define DIGITAL_PAIR_TOUCHED (PORT_TOUCHED | PORT_TOUCHED << 4)
+
+// a set of digital ports, one bit per port, port 0 in bit 0 of byte 0
+#define DIGITAL_SET_BYTES ((DIGITAL_PORTS + 7) / 8)
 
 unsigned char portState[PORT_STATE_SIZE];
 
+// What the Ports screen last painted, in the same layout as portState. The
+// touched bit marks a port as painted since the screen was opened.
+unsigned char renderedState[PORT_STATE_SIZE];
+
+// Every read flips the read pulse, so a port polled each slice would differ
+// from what was painted each slice. The pulse only counts as a change on the
+// slices where markerDue is set, once a second.
+char markerDue;
+
+// I/O counters since power up, used to size controllers
+#define IO_ANALOG_READS 0
+#define IO_DIGITAL_READS 1
+#define IO_WRITES 2
+#define IO_REDRAWS 3
+#define IO_SKIPPED_WRITES 4
+#define IO_COUNTERS 5
+
+unsigned long ioCounters[IO_COUNTERS];
+
+// Analog channels converted during the current slice. A channel's sample is
+// valid while its bit is set in sampledPorts, timeSlice clears them all.
+int          samples[ANALOG_PORTS];
+unsigned int sampledPorts;
+
+// ANALOG HISTORY
+// The last HISTORY_SAMPLES conversions of every analog port at full 10 bit
+// resolution, for the sparklines of the Ports screen. Samples are packed
+// HISTORY_BITS apart, HISTORY_PORT_BYTES per port; historyHead holds the
+// next slot in its low bits and HISTORY_FULL once the ring wrapped.
+#define HISTORY_SAMPLES 8
+#define HISTORY_BITS 10
+#define HISTORY_PORT_BYTES (HISTORY_SAMPLES * HISTORY_BITS / 8)
+#define HISTORY_FULL 0x80
+
+unsigned char history[ANALOG_PORTS * HISTORY_PORT_BYTES];
+unsigned char historyHead[ANALOG_PORTS];
+unsigned int  historyChanged;  // one bit per port, samples not painted yet
+
+// OUTPUT SHADOW
+// Last level written to each digital port, valid while its bit is set in
+// outputKnown. Writing the same level again is skipped. Reads keep it: an
+// output reads back its latch, and writing an input only sets its pull-up,
+// which is what the shadow records. Registering a port as an input forgets it.
+unsigned char outputShadow[DIGITAL_SET_BYTES];
+unsigned char outputKnown[DIGITAL_SET_BYTES];
+
+// DIGITAL INPUTS
+// Registered inputs are read once per slice for all apps. A new level only
+// becomes stable after it was read on inputDebounce consecutive slices, and
+// every stable change counts as an edge. The table lives in RAM, so it starts
+// empty on power up and apps register again in whenPowered.
+// Apps are not told when they are removed, so reading the level renews a
+// lease on the slot, and a slot nobody read for INPUT_LEASE slices is freed.
+#define MAX_INPUTS 8
+#define INPUT_LEASE 50
+
+char          inputPort[MAX_INPUTS];
+unsigned char inputUsers[MAX_INPUTS];  // 0 == free slot
+unsigned char inputDebounce[MAX_INPUTS];
+unsigned char inputPending[MAX_INPUTS];  // slices the read level differed
+unsigned char inputIdle[MAX_INPUTS];     // slices since the level was read
+unsigned char inputLevels;               // stable level, one bit per input
+unsigned int  inputEdges[MAX_INPUTS];
+
 namespace pm {
 
     int cardinality() {
@@ -63,76 +144,109 @@ namespace pm {
         for (int i = 0; i < PORT_STATE_SIZE; i++) {
             portState[i] = 0;
         }
+        for (int i = 0; i < IO_COUNTERS; i++)
+            ioCounters[i] = 0;
+        sampledPorts = 0;
+        for (int i = 0; i < DIGITAL_SET_BYTES; i++)
+            outputKnown[i] = 0;
+        for (int i = 0; i < ANALOG_PORTS; i++)
+            historyHead[i] = 0;
+        historyChanged = 0;
     }
 
-    // BIT ARITHMETIC
+    // WHOLE PORT ARITHMETIC
 
-    void setBit(int isAnalog, int port, int position, int value) {
+    int portBits(unsigned char* state, int isAnalog, int port) {
         if (isAnalog)
-            position = 4 * 54 + port * 8 + position;
-        else
-            position = port * 4 + position;
-        int byteOffset = position / 8;
-        int bitOffset = position % 8;
-        int mask = 1 << bitOffset;
-        if (value)
-            portState[byteOffset] = portState[byteOffset] | mask;
-        else
-            portState[byteOffset] = (portState[byteOffset] | mask) - mask;
+            return state[ANALOG_OFFSET + port];
+        return (state[port >> 1] >> ((port & 1) << 2)) & 0x0F;
+    }
+
+    // replaces the bits selected by mask with the ones in bits
+    void setPortBits(unsigned char* state, int isAnalog, int port, int mask, int bits) {
+        int offset = ANALOG_OFFSET + port;
+        if (!isAnalog) {
+            int shift = (port & 1) << 2;
+            mask = (mask & 0x0F) << shift;
+            bits <<= shift;
+            offset = port >> 1;
+        }
+        state[offset] = (state[offset] & ~mask) | (bits & mask);
     }
 
-    int getBit(int isAnalog, int port, int position) {
+    int valueBits(int isAnalog, int val) {
         if (isAnalog)
-            position = 4 * 54 + port * 8 + position;
-        else
-            position = port * 4 + position;
-        int byteOffset = position / 8;
-        int bitOffset = position % 8;
-        int mask = 1 << bitOffset;
-        return (portState[byteOffset] & mask) > 0;
+            return (val / 32 & 0x1F) << PORT_VALUE_SHIFT;
+        return (val != 0) << PORT_VALUE_SHIFT;
     }
 
     void setTouched(int isAnalog, int port, int isTouched) {
-        setBit(isAnalog, port, 0, isTouched);
+        setPortBits(portState, isAnalog, port, PORT_TOUCHED, isTouched ? PORT_TOUCHED : 0);
     }
 
     void setConfigured(int isAnalog, int port, int configured) {
-        setBit(isAnalog, port, 2, configured);
+        setPortBits(portState, isAnalog, port, PORT_CONFIGURED, configured ? PORT_CONFIGURED : 0);
     }
 
     void setValue(int isAnalog, int port, int val) {
-        if (isAnalog) {
-            val = val / 32;
-            setBit(isAnalog, port, 3, val >> 4);
-            setBit(isAnalog, port, 4, (val >> 3) % 2);
-            setBit(isAnalog, port, 5, (val >> 2) % 2);
-            setBit(isAnalog, port, 6, (val >> 1) % 2);
-            setBit(isAnalog, port, 7, val % 2);
-        } else
-            setBit(isAnalog, port, 3, val);
+        setPortBits(portState, isAnalog, port, 0xFF << PORT_VALUE_SHIFT, valueBits(isAnalog, val));
     }
 
     int isConfigured(int isAnalog, int port) {
-        return getBit(isAnalog, port, 2);
+        return (portBits(portState, isAnalog, port) & PORT_CONFIGURED) > 0;
     }
 
     int isAccessed(int isAnalog, int port) {
-        return getBit(isAnalog, port, 1);
+        return (portBits(portState, isAnalog, port) & PORT_ACCESSED) > 0;
     }
 
     void setAccessed(int isAnalog, int port) {
-        setBit(isAnalog, port, 1, 1 - isAccessed(isAnalog, port));
+        setPortBits(portState, isAnalog, port, PORT_ACCESSED, ~portBits(portState, isAnalog, port));
     }
 
     int value(int isAnalog, int port) {
+        int val = portBits(portState, isAnalog, port) >> PORT_VALUE_SHIFT;
         if (isAnalog)
-            return 31 * (getBit(isAnalog, port, 3) * 16 + getBit(isAnalog, port, 4) * 8 +
-                         getBit(isAnalog, port, 5) * 4 + getBit(isAnalog, port, 6) * 2 + getBit(isAnalog, port, 7));
-        return getBit(isAnalog, port, 3);
+            return 33 * val;
+        return val;
     }
 
     int isTouched(int isAnalog, int port) {
-        return getBit(isAnalog, port, 0);
+        return (portBits(portState, isAnalog, port) & PORT_TOUCHED) > 0;
+    }
+
+    // Marks the port as configured and touched and stores its value in one
+    // read/modify/write, optionally flipping the read pulse
+    void access(int isAnalog, int port, int val, int pulse) {
+        int bits = portBits(portState, isAnalog, port);
+        if (pulse)
+            bits ^= PORT_ACCESSED;
+        bits = (bits & PORT_ACCESSED) | PORT_TOUCHED | PORT_CONFIGURED | valueBits(isAnalog, val);
+        setPortBits(portState, isAnalog, port, 0xFF, bits);
+    }
+
+    // BULK OPERATIONS
+
+    void setAllTouched(int isTouched) {
+        for (int i = 0; i < ANALOG_OFFSET; i++)
+            portState[i] = isTouched ? portState[i] | DIGITAL_PAIR_TOUCHED : portState[i] & ~DIGITAL_PAIR_TOUCHED;
+        for (int i = ANALOG_OFFSET; i < PORT_STATE_SIZE; i++)
+            portState[i] = isTouched ? portState[i] | PORT_TOUCHED : portState[i] & ~PORT_TOUCHED;
+    }
+
+    // calls fn for every touched port, analogs first, skipping untouched bytes
+    void forEachTouched(void (*fn)(int, int)) {
+        for (int i = 0; i < ANALOG_PORTS; i++)
+            if (portState[ANALOG_OFFSET + i] & PORT_TOUCHED)
+                fn(IS_ANALOG, i);
+        for (int i = 0; i < ANALOG_OFFSET; i++) {
+            if (!(portState[i] & DIGITAL_PAIR_TOUCHED))
+                continue;
+            if (portState[i] & PORT_TOUCHED)
+                fn(IS_DIGITAL, 2 * i);
+            if (portState[i] & PORT_TOUCHED << 4)
+                fn(IS_DIGITAL, 2 * i + 1);
+        }
     }
 
     // READING BITS
@@ -151,43 +265,240 @@ namespace pm {
             fatalError(1001, port);
     }
 
+    // ANALOG HISTORY
+
+    int historySample(int port, int slot) {
+        int bit = slot * HISTORY_BITS;
+        unsigned char* p = history + port * HISTORY_PORT_BYTES + (bit >> 3);
+        unsigned int word = p[0] | (unsigned int)p[1] << 8;
+        return (word >> (bit & 7)) & 0x3FF;
+    }
+
+    void setHistorySample(int port, int slot, int val) {
+        int bit = slot * HISTORY_BITS;
+        unsigned char* p = history + port * HISTORY_PORT_BYTES + (bit >> 3);
+        unsigned int mask = 0x3FFU << (bit & 7);
+        unsigned int word = ((p[0] | (unsigned int)p[1] << 8) & ~mask) | ((unsigned int)val << (bit & 7) & mask);
+        p[0] = word & 0xFF;
+        p[1] = word >> 8;
+    }
+
+    int historyLength(int port) {
+        if (historyHead[port] & HISTORY_FULL)
+            return HISTORY_SAMPLES;
+        return historyHead[port];
+    }
+
+    // i-th sample of the port, oldest first
+    int historyAt(int port, int i) {
+        int n = historyLength(port);
+        int next = historyHead[port] & ~HISTORY_FULL;
+        return historySample(port, (next - n + i + HISTORY_SAMPLES) % HISTORY_SAMPLES);
+    }
+
+    void record(int port, int val) {
+        int next = historyHead[port] & ~HISTORY_FULL;
+        setHistorySample(port, next, val);
+        next++;
+        if (next == HISTORY_SAMPLES)
+            historyHead[port] = HISTORY_FULL;
+        else
+            historyHead[port] = (historyHead[port] & HISTORY_FULL) | next;
+        historyChanged |= 1U << port;
+    }
+
     int _analogRead(int port) {
         invalid(IS_ANALOG, port);
         int val = analogRead(port);
-        setConfigured(IS_ANALOG, port, 1);
-        setTouched(IS_ANALOG, port, 1);
-        setValue(IS_ANALOG, port, val / 32);
-        setAccessed(IS_ANALOG, port);
+        ioCounters[IO_ANALOG_READS]++;
+        access(IS_ANALOG, port, val, 1);
+        record(port, val);
         return val;
     }
 
+    // converts the channel once per slice, later reads get the same sample
+    int sample(int port) {
+        invalid(IS_ANALOG, port);
+        unsigned int mask = 1U << port;
+        if (!(sampledPorts & mask)) {
+            samples[port] = _analogRead(port);
+            sampledPorts |= mask;
+        }
+        return samples[port];
+    }
+
     int _digitalRead(int port) {
         invalid(IS_DIGITAL, port);
         int val = digitalRead(port);
-        setConfigured(IS_DIGITAL, port, 1);
-        setTouched(IS_DIGITAL, port, 1);
-        setAccessed(IS_DIGITAL, port);
-        setValue(IS_DIGITAL, port, val);
+        ioCounters[IO_DIGITAL_READS]++;
+        access(IS_DIGITAL, port, val, 1);
         return val;
     }
 
     void _analogWrite(int port, int value) {
         invalid(IS_ANALOG, port);
-        setConfigured(IS_ANALOG, port, 1);
-        setTouched(IS_ANALOG, port, 1);
-        setValue(IS_ANALOG, port, value);
+        access(IS_ANALOG, port, value, 0);
+        ioCounters[IO_WRITES]++;
         analogWrite(port, value);
     }
 
+    // true when port already has the level, otherwise records it
+    int unchangedOutput(int port, int value) {
+        unsigned char bit = 1 << (port & 7);
+        unsigned char level = value ? bit : 0;
+        if ((outputKnown[port >> 3] & bit) && (outputShadow[port >> 3] & bit) == level) {
+            ioCounters[IO_SKIPPED_WRITES]++;
+            return 1;
+        }
+        outputKnown[port >> 3] |= bit;
+        outputShadow[port >> 3] = (outputShadow[port >> 3] & ~bit) | level;
+        return 0;
+    }
+
     void _digitalWrite(int port, int value) {
         invalid(IS_DIGITAL, port);
-        setConfigured(IS_DIGITAL, port, 1);
-        setTouched(IS_DIGITAL, port, 1);
-        setAccessed(IS_DIGITAL, port);
-        setValue(IS_DIGITAL, port, value);
+        if (unchangedOutput(port, value))
+            return;
+        access(IS_DIGITAL, port, value, 1);
+        ioCounters[IO_WRITES]++;
         digitalWrite(port, value);
     }
 
+    // PORT SETS
+    // A set is validated once and counted once, then every port in it is
+    // accessed without the per call checks of _digitalRead/_digitalWrite.
+
+    int setSize(const unsigned char* ports) {
+        if (ports[DIGITAL_SET_BYTES - 1] >> (DIGITAL_PORTS % 8))
+            fatalError(1001, DIGITAL_PORTS);
+        int n = 0;
+        for (int i = 0; i < DIGITAL_SET_BYTES; i++)
+            for (unsigned char b = ports[i]; b; b &= b - 1)
+                n++;
+        return n;
+    }
+
+    // sets the bits of levels for the ports in the set that read high
+    void readSet(const unsigned char* ports, unsigned char* levels) {
+        ioCounters[IO_DIGITAL_READS] += setSize(ports);
+        for (int i = 0; i < DIGITAL_SET_BYTES; i++) {
+            if (!ports[i])
+                continue;
+            unsigned char read = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                if (!(ports[i] & 1 << bit))
+                    continue;
+                int val = digitalRead(i * 8 + bit);
+                access(IS_DIGITAL, i * 8 + bit, val, 1);
+                if (val)
+                    read |= 1 << bit;
+            }
+            levels[i] = (levels[i] & ~ports[i]) | read;
+        }
+    }
+
+    // writes the bit of levels to every port in the set that does not have it
+    void writeSet(const unsigned char* ports, const unsigned char* levels) {
+        setSize(ports);
+        for (int i = 0; i < DIGITAL_SET_BYTES; i++)
+            for (int bit = 0; ports[i] >> bit; bit++) {
+                if (!(ports[i] & 1 << bit))
+                    continue;
+                int val = (levels[i] >> bit) & 1;
+                if (unchangedOutput(i * 8 + bit, val))
+                    continue;
+                ioCounters[IO_WRITES]++;
+                access(IS_DIGITAL, i * 8 + bit, val, 1);
+                digitalWrite(i * 8 + bit, val);
+            }
+    }
+
+    // DIGITAL INPUTS
+
+    int findInput(int port) {
+        for (int i = 0; i < MAX_INPUTS; i++)
+            if (inputUsers[i] && inputPort[i] == port)
+                return i;
+        return -1;
+    }
+
+    // Returns the input's slot, -1 when the table is full. Apps that share a
+    // port share the slot, with the longest debounce any of them asked for.
+    int registerInput(int port, int debounce) {
+        invalid(IS_DIGITAL, port);
+        int i = findInput(port);
+        if (i == -1) {
+            for (i = 0; i < MAX_INPUTS && inputUsers[i]; i++)
+                ;
+            if (i == MAX_INPUTS)
+                return -1;
+            pinMode(port, INPUT);
+            outputKnown[port >> 3] &= ~(1 << (port & 7));
+            inputPort[i] = port;
+            inputDebounce[i] = 0;
+            inputPending[i] = 0;
+            inputEdges[i] = 0;
+            inputIdle[i] = 0;
+            if (_digitalRead(port))
+                inputLevels |= 1 << i;
+            else
+                inputLevels &= ~(1 << i);
+        }
+        inputUsers[i]++;
+        if (debounce > inputDebounce[i])
+            inputDebounce[i] = debounce;
+        return i;
+    }
+
+    void releaseInput(int port) {
+        int i = findInput(port);
+        if (i != -1)
+            inputUsers[i]--;
+    }
+
+    // all registered inputs are read as one set
+    void sampleInputs() {
+        unsigned char ports[DIGITAL_SET_BYTES] = {0};
+        unsigned char levels[DIGITAL_SET_BYTES] = {0};
+        for (int i = 0; i < MAX_INPUTS; i++) {
+            if (inputUsers[i] && ++inputIdle[i] > INPUT_LEASE)
+                inputUsers[i] = 0;
+            if (inputUsers[i])
+                ports[inputPort[i] >> 3] |= 1 << (inputPort[i] & 7);
+        }
+        readSet(ports, levels);
+        for (int i = 0; i < MAX_INPUTS; i++) {
+            if (!inputUsers[i])
+                continue;
+            unsigned char bit = 1 << i;
+            int level = (levels[inputPort[i] >> 3] >> (inputPort[i] & 7)) & 1;
+            int changed = level != !!(inputLevels & bit);
+            if (!changed)
+                inputPending[i] = 0;
+            else if (++inputPending[i] >= inputDebounce[i]) {
+                inputLevels ^= bit;
+                inputEdges[i]++;
+                inputPending[i] = 0;
+            }
+        }
+    }
+
+    // stable level of a registered input, a direct read for any other port
+    int inputLevel(int port) {
+        int i = findInput(port);
+        if (i == -1)
+            return _digitalRead(port);
+        inputIdle[i] = 0;
+        return (inputLevels >> i) & 1;
+    }
+
+    unsigned int inputEdgeCount(int port) {
+        int i = findInput(port);
+        if (i == -1)
+            return 0;
+        return inputEdges[i];
+    }
+
     // draws a port
 
     void drawReading(int x, int y) {
@@ -207,6 +518,18 @@ namespace pm {
                     fillRect(x + i, y + j, 1, 1);
     }
 
+    // one column per sample, the newest on the right
+    void drawSparkline(int port, int x, int y) {
+        setColor(colorWhite);
+        fillRect(x, y, 13, 13);
+        setColor(colorBlack);
+        int n = historyLength(port);
+        for (int i = 0; i < n; i++) {
+            int h = 1 + historyAt(port, i) * 10L / 1023;
+            fillRect(x + 12 - n + i, y + 12 - h, 1, h);
+        }
+    }
+
     void drawDegrade(int x, int y, int h) {
         setColor(colorWhite);
         fillRect(x, y, h, h);
@@ -234,29 +557,71 @@ namespace pm {
             return;
         }
 
-        if (analog) {
-            int val = 255 - value(analog, port) / 4;
-            setColor(colorFromRGB(val, val, val));
-        } else {
-            int val = value(analog, port);
-            setColor(colorWhite);
-            if (val == 1)
-                setColor(colorBlack);
+        if (analog && historyLength(port))
+            drawSparkline(port, x, y);
+        else {
+            if (analog) {
+                int val = 255 - value(analog, port) / 4;
+                setColor(colorFromRGB(val, val, val));
+            } else {
+                int val = value(analog, port);
+                setColor(colorWhite);
+                if (val == 1)
+                    setColor(colorBlack);
+            }
+            fillRect(x, y, 13, 13);
         }
-        fillRect(x, y, 13, 13);
 
         if (isAccessed(analog, port)) {
             drawReading(x, y);
         }
     }
 
+    // only the bits that change what drawPort paints
+    int visibleBits(int analog, int port) {
+        int bits = portBits(portState, analog, port);
+        if (!(bits & PORT_CONFIGURED))
+            return PORT_TOUCHED;
+        return bits | PORT_TOUCHED;
+    }
+
+    void drawTouchedPort(int analog, int port) {
+        int visible = visibleBits(analog, port);
+        int rendered = portBits(renderedState, analog, port);
+        int compared = markerDue ? visible : (visible & ~PORT_ACCESSED) | (rendered & PORT_ACCESSED);
+        int sparkline = 0;
+        if (analog && historyLength(port)) {
+            // the sparkline stands for the value, and new samples show up
+            // once a second
+            int valueMask = 0x1F << PORT_VALUE_SHIFT;
+            compared = (compared & ~valueMask) | (rendered & valueMask);
+            sparkline = markerDue && (historyChanged & 1U << port);
+            if (sparkline)
+                historyChanged &= ~(1U << port);
+        }
+        if (!sparkline && rendered == compared)
+            return;
+        setPortBits(renderedState, analog, port, 0xFF, visible);
+        ioCounters[IO_REDRAWS]++;
+        drawPort(analog, port, 0);
+    }
+
+    // A port that is not read again after a deferred pulse or a new sample
+    // would keep them unpainted, so the marker slice touches it.
+    void touchDeferred() {
+        for (int i = 0; i < ANALOG_PORTS; i++)
+            if (historyChanged & 1U << i ||
+                (portBits(portState, IS_ANALOG, i) ^ portBits(renderedState, IS_ANALOG, i)) & PORT_ACCESSED)
+                setTouched(IS_ANALOG, i, 1);
+        for (int i = 0; i < DIGITAL_PORTS; i++)
+            if ((portBits(portState, IS_DIGITAL, i) ^ portBits(renderedState, IS_DIGITAL, i)) & PORT_ACCESSED)
+                setTouched(IS_DIGITAL, i, 1);
+    }
+
     void refreshPorts() {
-        for (int i = 0; i < 16; i++)
-            if (isTouched(IS_ANALOG, i))
-                drawPort(IS_ANALOG, i, 0);
-        for (int i = 0; i < 54; i++)
-            if (isTouched(IS_DIGITAL, i))
-                drawPort(IS_DIGITAL, i, 0);
+        if (markerDue)
+            touchDeferred();
+        forEachTouched(drawTouchedPort);
     }
 
     void drawPortsTable(const char* title, int rows, int x, int y) {
@@ -289,13 +654,13 @@ namespace pm {
     }
 
     void timeSlice(int fg, frequency frequency) {
+        sampledPorts = 0;
+        sampleInputs();
         if (!fg)
             return;
+        markerDue = frequency.type == second;
         refreshPorts();
-        for (int i = 0; i < 16; i++)
-            setTouched(IS_ANALOG, i, 0);
-        for (int i = 0; i < 54; i++)
-            setTouched(IS_DIGITAL, i, 0);
+        setAllTouched(0);
     }
 
     void drawLegend() {
@@ -346,12 +711,10 @@ namespace pm {
         for (int i = 54; i < 60; i++) {
             drawPort(IS_DIGITAL, i, UNAVAILABLE);
         }
-        for (int i = 0; i < 16; i++) {
-            setTouched(IS_ANALOG, i, 1);
-        }
-        for (int i = 1; i < 54; i++) {
-            setTouched(IS_DIGITAL, i, 1);
-        }
+        for (int i = 0; i < PORT_STATE_SIZE; i++)
+            renderedState[i] = 0;
+        setAllTouched(1);
+        setTouched(IS_DIGITAL, 0, 0);
 
         drawPort(0, 0, UNAVAILABLE);
         toolbarAddHome();
@@ -398,23 +761,73 @@ namespace pm {
         if (kind == 0)
             return 0;
         if (kind == 1)
-            return digitalRead(params[0]);
+            return _digitalRead(params[0]);
         if (kind == 2)
-            return !digitalRead(params[0]);
+            return !_digitalRead(params[0]);
         return 0;
     }
 
     void performAction(int kind, uint16_t* params) {
         if (kind == 2)
-            digitalWrite(params[0], 1);
+            _digitalWrite(params[0], 1);
+    }
+
+    // COUNTERS
+
+    const char* ioCounterDef(int counter) {
+        if (counter == IO_ANALOG_READS)
+            return PSTR("Analog reads: ");
+        if (counter == IO_DIGITAL_READS)
+            return PSTR("Digital reads: ");
+        if (counter == IO_WRITES)
+            return PSTR("Port writes: ");
+        if (counter == IO_REDRAWS)
+            return PSTR("Port redraws: ");
+        if (counter == IO_SKIPPED_WRITES)
+            return PSTR("Skipped writes: ");
+        return 0;
     }
 
 }  // namespace pm
 
+int pmAnalogRead(int port) {
+    return pm::sample(port);
+}
+
 int pmDigitalRead(int port) {
     return pm::_digitalRead(port);
 }
 
+// Registers port as a debounced input: its level has to hold for debounce
+// slices before pmInputLevel reports it. Returns -1 when no slot is free.
+int pmRegisterInput(int port, int debounce) {
+    return pm::registerInput(port, debounce);
+}
+
+void pmReleaseInput(int port) {
+    pm::releaseInput(port);
+}
+
+int pmInputLevel(int port) {
+    return pm::inputLevel(port);
+}
+
+// Number of stable level changes of a registered input since it was registered
+unsigned int pmInputEdges(int port) {
+    return pm::inputEdgeCount(port);
+}
+
+// Reads every port set in ports, a bitmap of DIGITAL_SET_BYTES bytes, into
+// the same bits of levels. Bits of ports not in the set are left as they are.
+void pmDigitalReadSet(const unsigned char* ports, unsigned char* levels) {
+    pm::readSet(ports, levels);
+}
+
+// Writes the bit of levels to every port set in ports
+void pmDigitalWriteSet(const unsigned char* ports, const unsigned char* levels) {
+    pm::writeSet(ports, levels);
+}
+
 void pmDigitalWrite(int port, int value) {
     pm::_digitalWrite(port, value);
 }
@@ -422,3 +835,17 @@ void pmDigitalWrite(int port, int value) {
 void pmAnalogWrite(int port, int value) {
     pm::_analogWrite(port, value);
 }
+
+// Name of an I/O counter, 0 when there are no more counters
+const char* pmIOCounterDef(int counter) {
+    return pm::ioCounterDef(counter);
+}
+
+unsigned long pmIOCount(int counter) {
+    return ioCounters[counter];
+}
+
+// SRAM taken by the analog history of the Ports screen
+int pmHistoryBytes() {
+    return sizeof(history) + sizeof(historyHead) + sizeof(historyChanged);
+}
@@ -24,6 +24,13 @@
 
 #include "AquaOS.h"
 
+int pmAnalogRead(int port);
+int monitorFullRedraw();
+
+#define TDS_SHIFT 12
+// largest factor a 10 bit reading can be multiplied by, and rounded, in 32 bits
+#define TDS_MAX_FACTOR ((0xFFFFFFFFUL - (1UL << (TDS_SHIFT - 1))) / 1023)
+
 namespace tds {
 
     // PERSISTANT VARS
@@ -32,24 +39,68 @@ namespace tds {
     int  calibratedAnalogValue;     // -1 == not configured
     int  calibrationSolutionValue;  // -1 == not configured
 
+    // VOLATILE VARS
+
+    unsigned long factor;   // TDS per analog unit, shifted by TDS_SHIFT
+    long          current;  // TDS of this slice's reading
+    char          sampled;  // current is valid
+    long          shown;    // TDS on the monitor tile
+    int           logged;   // last value logged, -1 if none since power up
+
     // actions and screens
     void startScreen();
     void configure();
 
+    // Precomputes the conversion factor, so tds() is a multiply and a shift
+    void calibrate() {
+        if (calibratedAnalogValue <= 0 || calibrationSolutionValue <= 0)
+            factor = 0;
+        else
+            factor = (((unsigned long)calibrationSolutionValue << TDS_SHIFT) + calibratedAnalogValue / 2) /
+                     calibratedAnalogValue;
+        // a near zero calibration reading saturates instead of overflowing
+        if (factor > TDS_MAX_FACTOR)
+            factor = TDS_MAX_FACTOR;
+    }
+
     void whenCreated() {
         port = 10;
         calibratedAnalogValue = 313;
         calibrationSolutionValue = 100;
+        calibrate();
     }
 
     void registerVars() {
         pregister(&port);
         pregister(&calibratedAnalogValue);
         pregister(&calibrationSolutionValue);
+        mregister(&factor);
+        mregister(&current);
+        mregister(&sampled);
+        mregister(&shown);
+        mregister(&logged);
     }
 
-    float tds(unsigned int analogValue) {
-        return analogValue * calibrationSolutionValue / calibratedAnalogValue;
+    long tds(unsigned int analogValue) {
+        return (analogValue * factor + (1UL << (TDS_SHIFT - 1))) >> TDS_SHIFT;
+    }
+
+    // Converts the reading once per slice, rules and screens compare against it
+    void sample() {
+        current = tds(pmAnalogRead(port));
+        sampled = 1;
+    }
+
+    long currentTDS() {
+        if (!sampled)
+            sample();
+        return current;
+    }
+
+    void whenPowered() {
+        sampled = 0;
+        logged = -1;
+        calibrate();
     }
 
     const char* conditionsDef(int kind) {
@@ -62,9 +113,9 @@ namespace tds {
 
     int evalCondition(int kind, uint16_t* params) {
         if (kind == 0)
-            return tds(analogRead(port)) < params[0];
+            return currentTDS() < params[0];
         if (kind == 1)
-            return tds(analogRead(port)) >= params[0];
+            return currentTDS() >= params[0];
         return 0;
     }
 
@@ -77,8 +128,10 @@ namespace tds {
     // CONFIGURING ANALOG PORT
 
     void portSet(int p) {
-        if (p)
+        if (p) {
             port = p;
+            sampled = 0;
+        }
         goToScreen(configure);
     }
 
@@ -87,8 +140,11 @@ namespace tds {
     }
 
     void solutionSet(int valid, float value) {
-        if (valid)
+        if (valid) {
             calibrationSolutionValue = (int)value;
+            calibrate();
+            sampled = 0;
+        }
         goToScreen(configure);
     }
 
@@ -97,7 +153,9 @@ namespace tds {
     }
 
     void read(int params) {
-        calibratedAnalogValue = analogRead(port);
+        calibratedAnalogValue = pmAnalogRead(port);
+        calibrate();
+        sampled = 0;
         message(PSTR("The value was read"), configure);
     }
 
@@ -139,15 +197,18 @@ namespace tds {
     void monitor(int x, int y, int w, int h) {
         if (!port)
             return;
+        if (!monitorFullRedraw() && shown == currentTDS())
+            return;
+        shown = currentTDS();
         fillRect(x, y, w, h);
         setColor(colorWhite);
         setPrintX(x + 69);
         setPrintY(y + 30);
-        print(tds(analogRead(port)));
+        print(shown);
     }
 
     int state() {
-        return analogRead(port);
+        return pmAnalogRead(port);
     }
 
     void showState() {
@@ -160,12 +221,24 @@ namespace tds {
         setNormalStyle();
         print(PSTR("TDS: "));
         cleanRestOfLine();
-        println(tds(analogRead(port)));
+        println(currentTDS());
+    }
+
+    // One entry a day, skipped when the reading did not move since the last
+    // one, so a steady probe does not fill the log with repeats
+    void logReading() {
+        int value = pmAnalogRead(port) / 4;
+        if (value == logged)
+            return;
+        logEvent(value);
+        logged = value;
     }
 
     void timeSlice(int fg, frequency frequency) {
+        if (port)
+            sample();
         if (frequency.type == day)
-            logEvent(analogRead(port) / 4);
+            logReading();
         if (fg && currentScreenIs(startScreen) && port && calibratedAnalogValue != -1 && calibrationSolutionValue != -1)
             showState();
     }
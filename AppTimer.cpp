@@ -24,6 +24,10 @@
 
 #include "AquaOS.h"
 
+int           ccClockDue(long time);
+unsigned long ccClockEpoch();
+unsigned int  ccClockElapsed();
+
 namespace timer {
     void startScreen();
 
@@ -62,11 +66,11 @@ namespace timer {
 
     int evalCondition(int kind, uint16_t* params) {
         if (kind == 0)
-            return params[2] == clockSecs() && params[0] == clockHours() && params[1] == clockMins();
+            return ccClockDue(params[0] * 3600L + params[1] * 60 + params[2]);
         if (kind == 1) {
-            if (params[0]==0)
+            if (params[0]==0 || params[1] >= params[0])
                 return 0;
-            return clockEpoch() % params[0] == params[1];
+            return (ccClockEpoch() + params[0] - params[1]) % params[0] < ccClockElapsed();
         }
         return 0;
     }
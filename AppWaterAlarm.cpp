@@ -26,13 +26,23 @@
 
 #include "AquaOS.h"
 
+#define WA_DEBOUNCE 5
+
+int  monitorFullRedraw();
+int  pmRegisterInput(int port, int debounce);
+void pmReleaseInput(int port);
+int  pmInputLevel(int port);
+
 namespace wa {
     void startScreen(void);
     void waWhenTimeSliced(frequency frequency);
     void screenConfigure(void);
+    void registerPort();
 
     char port;
     char touching;
+    char debounced;  // the ports manager had a slot for the port
+    char shown;  // touching on the monitor tile
 
     int configured() {
         return port;
@@ -53,6 +63,8 @@ namespace wa {
      */
     void whenCreated() {
         port = 17;
+        // whenPowered only runs on the next power up
+        registerPort();
     }
 
     int state() {
@@ -61,11 +73,23 @@ namespace wa {
 
     void registerVars() {
         mregister(&touching);
+        mregister(&debounced);
+        mregister(&shown);
         pregister(&port);
     }
 
+    // Without a free slot the port is still read, once per slice, but
+    // without debouncing, and the screen says so
+    void registerPort() {
+        debounced = pmRegisterInput(port, WA_DEBOUNCE) != -1;
+        if (!debounced)
+            pinMode(port, INPUT);
+    }
+
     void whenPowered() {
         touching = 0;
+        if (configured())
+            registerPort();
     }
 
     /*
@@ -81,6 +105,20 @@ namespace wa {
         return 0;
     }
 
+    /*
+     * Conditions only look at the state sampled in timeSlice, they never
+     * read the port themselves.
+     */
+    int evalCondition(int kind, uint16_t* params) {
+        if (!configured())
+            return 0;
+        if (kind == 0)
+            return touching;
+        if (kind == 1)
+            return !touching;
+        return 0;
+    }
+
     /*
      * The dashboard is giving this instance the rect defined by
      * the coordinates x,y and the dimensions w,h.
@@ -89,8 +127,13 @@ namespace wa {
      * (1,320,180), (2, 159,180), (4, 159,89).
      * The rect's background is black.
      * The font is the standard one (you can change it).
+     * When monitorFullRedraw() is false the rect still shows the last paint,
+     * so it is only repainted when touching changed.
      */
     void monitor(int x, int y, int w, int h) {
+        if (!monitorFullRedraw() && shown == touching)
+            return;
+        shown = touching;
         setPrintX(x + margin);
         setPrintY(y + margin);
         if (!configured()) {
@@ -135,8 +178,11 @@ namespace wa {
     }
 
     void configurePortCallback(int selectedPort) {
-        if (selectedPort) {
+        if (selectedPort && selectedPort != port) {
+            if (configured())
+                pmReleaseInput(port);
             port = selectedPort;
+            registerPort();
         }
         goToScreen(screenConfigure);
     }
@@ -165,6 +211,8 @@ namespace wa {
         setColor(colorBlack);
         print(PSTR("Listening on digital port "));
         println(port);
+        if (!debounced)
+            print(PSTR("Not debounced, too many inputs."));
         println();
 
         setPrintX(50);
@@ -186,8 +234,7 @@ namespace wa {
     void timeSlice(int fg, frequency frequency) {
         int exTouching = touching;
         if (configured()) {
-            pinMode(port, INPUT);
-            touching = pmDigitalRead(port);
+            touching = pmInputLevel(port);
             if (exTouching != touching)
                 logEvent(touching);
         }